@@ -0,0 +1,49 @@
+#include <stdbool.h>
+
+#include "esp_log.h"
+#include "esp_system.h"
+
+#include "admission.h"
+
+/* esp_http_server runs all URI handlers in its single task, so requests are
+ * already serialized. Admission only checks free heap, and holds the OTA slot
+ * from the start of an update until it fails or the device restarts. */
+
+static const char *TAG = "web_server_admission";
+
+typedef struct {
+    const char *name;
+    size_t      min_heap;
+} admission_limit_t;
+
+static const admission_limit_t admission_limits[ADMISSION_MAX] = {
+        [ADMISSION_OTA]     = { "ota",     CONFIG_WEBSERVER_OTA_MIN_HEAP },
+        [ADMISSION_UPLOAD]  = { "upload",  CONFIG_WEBSERVER_UPLOAD_MIN_HEAP },
+        [ADMISSION_REQUEST] = { "request", CONFIG_WEBSERVER_REQUEST_MIN_HEAP } };
+
+static bool admission_ota = false;
+
+bool admission_acquire(admission_class_t cls) {
+
+    const admission_limit_t *limit = &admission_limits[cls];
+    size_t free_heap = esp_get_free_heap_size();
+
+    if (cls == ADMISSION_OTA && admission_ota) {
+        ESP_LOGW(TAG, "Class \"%s\" rejected: firmware update already done or running", limit->name);
+        return false;
+    }
+
+    if (free_heap < limit->min_heap) {
+        ESP_LOGW(TAG, "Class \"%s\" rejected: free heap %d of %d bytes required",
+                limit->name, free_heap, limit->min_heap);
+        return false;
+    }
+
+    if (cls == ADMISSION_OTA) admission_ota = true;
+
+    return true;
+}
+
+void admission_release(admission_class_t cls) {
+    if (cls == ADMISSION_OTA) admission_ota = false;
+}
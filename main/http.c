@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <dirent.h>
 #include <math.h>
 #include <sys/param.h>
@@ -11,12 +12,19 @@
 #include "esp_wifi.h"
 #include "esp_http_server.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "esp_partition.h"
+#include "esp_spi_flash.h"
 #include "esp_ota_ops.h"
+#include "esp_image_format.h"
+#include "esp_http_client.h"
+#include "mbedtls/sha256.h"
 #include "cJSON.h"
 
 #include "http.h"
 #include "utils.h"
+#include "admission.h"
+#include "transfer.h"
 
 /* Buffer for OTA and another load or read from spiffs */
 #define OTA_BUF_LEN	 1024
@@ -33,15 +41,58 @@
 #define UPLOAD      "/upload/*"
 #define LIST        "/list"
 #define DELETE      "/delete"
+#define FIRMWARE    "/firmware"
+#define PULL        "/pull"
+#define CHECK       "/check"
+
+/* Server side include directives <!--#directive--> expanded in html pages */
+#define SSI_BEGIN   "<!--#"
+#define SSI_END     "-->"
+#define SSI_LISTING "listing"
+#define SSI_FREE    "free"
+#define SSI_USED    "used"
+#define SSI_INCLUDE "include "
+
+/* Max size of the file kept in memory by preload */
+#define ASSET_MAX_SIZE 8192
+
+/* Max length of JSON with the list of files to check */
+#define CHECK_MAX_LEN (MAX_BUFF_RW * 4)
+
+/* Max length of the peer URL for pull update */
+#define PULL_URL_LEN 256
+/* Header with the SHA-256 digest of the firmware image */
+#define HDR_SHA256  "X-Image-SHA256"
 
 static char *TAG = "web_server_http";
 
 static char *webserver_html_path = NULL;
 
+/* Set on Wi-Fi (re)connect, cleared by the first response after it */
+static bool webserver_first_response = true;
+
+typedef struct {
+    const char *name;
+    char       *data;
+    size_t      len;
+} webserver_asset_t;
+
+/* Files served from memory instead of SPIFFS */
+static webserver_asset_t webserver_assets[] = {
+        { .name = "index.html" },
+        { .name = "style.css" },
+        { .name = "scripts.js" },
+        { .name = "favicon.ico" },
+        { .name = "list.html" },
+        { .name = "terminal.css" } };
+
 static esp_err_t webserver_response(httpd_req_t *req);
 static esp_err_t webserver_upload(httpd_req_t *req);
 static esp_err_t webserver_list(httpd_req_t *req);
 static esp_err_t webserver_delete(httpd_req_t *req);
+static esp_err_t webserver_firmware(httpd_req_t *req);
+static esp_err_t webserver_pull(httpd_req_t *req);
+static esp_err_t webserver_check(httpd_req_t *req);
 
 static const httpd_uri_t uri_html = {
         .uri = URL,
@@ -63,6 +114,21 @@ static const httpd_uri_t delete_html = {
         .method = HTTP_POST,
         .handler = webserver_delete };
 
+static const httpd_uri_t firmware_html = {
+        .uri = FIRMWARE,
+        .method = HTTP_GET,
+        .handler = webserver_firmware };
+
+static const httpd_uri_t pull_html = {
+        .uri = PULL,
+        .method = HTTP_POST,
+        .handler = webserver_pull };
+
+static const httpd_uri_t check_html = {
+        .uri = CHECK,
+        .method = HTTP_POST,
+        .handler = webserver_check };
+
 static void reboot_task(void *pvParameter) {
 
     vTaskDelay(3000 / portTICK_PERIOD_MS);
@@ -71,6 +137,248 @@ static void reboot_task(void *pvParameter) {
     vTaskDelete(NULL);
 }
 
+static void transfer_report(const char *what, size_t len, int64_t start) {
+
+    int64_t ms = (esp_timer_get_time() - start) / 1000;
+
+    printf("%s transferred finished: %d bytes in %lld ms, %lld KB/s, transfer mode \"%s\"\n",
+            what, len, ms, ms ? len / ms : 0, transfer_mode_name());
+}
+
+/* Reject the request without reading its body */
+static esp_err_t webserver_busy(httpd_req_t *req) {
+
+    char retry_after[12];
+    char *err = "Server busy, try again later";
+
+    ESP_LOGW(TAG, "%s: %s", err, req->uri);
+
+    sprintf(retry_after, "%d", CONFIG_WEBSERVER_RETRY_AFTER);
+
+    httpd_resp_set_status(req, "503 Service Unavailable");
+    httpd_resp_set_type(req, HTTPD_TYPE_TEXT);
+    httpd_resp_set_hdr(req, "Retry-After", retry_after);
+    httpd_resp_set_hdr(req, "Connection", "close");
+    httpd_resp_sendstr(req, err);
+
+    /* Failure closes the connection, so the body is not received */
+    return ESP_FAIL;
+}
+
+static char* ota_begin_err(esp_err_t ret) {
+    switch (ret) {
+        case ESP_ERR_INVALID_ARG:
+            return "Partition or out_handle arguments were NULL, or not OTA app partition";
+        case ESP_ERR_NO_MEM:
+            return "Cannot allocate memory for OTA operation";
+        case ESP_ERR_OTA_PARTITION_CONFLICT:
+            return "Partition holds the currently running firmware, cannot update in place";
+        case ESP_ERR_NOT_FOUND:
+            return "Partition argument not found in partition table";
+        case ESP_ERR_OTA_SELECT_INFO_INVALID:
+            return "The OTA data partition contains invalid data";
+        case ESP_ERR_INVALID_SIZE:
+            return "Partition doesn't fit in configured flash size";
+        case ESP_ERR_FLASH_OP_TIMEOUT:
+        case ESP_ERR_FLASH_OP_FAIL:
+            return "Flash write failed";
+        case ESP_ERR_OTA_ROLLBACK_INVALID_STATE:
+            return "The running app has not confirmed state";
+        default:
+            return "Unknown error";
+    }
+}
+
+static char* ota_write_err(esp_err_t ret) {
+    switch (ret) {
+        case ESP_ERR_INVALID_ARG:
+            return "Handle is invalid";
+        case ESP_ERR_OTA_VALIDATE_FAILED:
+            return "First byte of image contains invalid app image magic byte";
+        case ESP_ERR_FLASH_OP_TIMEOUT:
+        case ESP_ERR_FLASH_OP_FAIL:
+            return "Flash write failed";
+        case ESP_ERR_OTA_SELECT_INFO_INVALID:
+            return "OTA data partition has invalid contents";
+        default:
+            return "Unknown error";
+    }
+}
+
+static char* ota_end_err(esp_err_t ret) {
+    switch (ret) {
+        case ESP_ERR_NOT_FOUND:
+            return "OTA handle was not found";
+        case ESP_ERR_INVALID_ARG:
+            return "Handle was never written to";
+        case ESP_ERR_OTA_VALIDATE_FAILED:
+            return "OTA image is invalid";
+        case ESP_ERR_INVALID_STATE:
+            return "Internal error writing the final encrypted bytes to flash";
+        default:
+            return "Unknown error";
+    }
+}
+
+
+/* OTA writer. With WEBSERVER_OTA_SKIP_UNCHANGED the image is written sector by
+ * sector straight to the partition, and sectors already holding the same
+ * contents are neither erased nor written. */
+typedef struct {
+    const esp_partition_t *partition;
+    esp_ota_handle_t       handle;
+    uint8_t               *sector;      /* Incoming sector */
+    uint8_t               *flash;       /* Same sector read from partition */
+    size_t                 len;         /* Bytes collected in sector */
+    size_t                 offset;      /* Sector offset in partition */
+    uint32_t               sectors;
+    uint32_t               skipped;
+} ota_writer_t;
+
+static esp_err_t ota_writer_begin(ota_writer_t *ota, const esp_partition_t *partition) {
+
+    memset(ota, 0, sizeof(ota_writer_t));
+    ota->partition = partition;
+
+#if CONFIG_WEBSERVER_OTA_SKIP_UNCHANGED
+    if (partition->type != ESP_PARTITION_TYPE_APP) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (partition == esp_ota_get_running_partition()) {
+        return ESP_ERR_OTA_PARTITION_CONFLICT;
+    }
+
+#if CONFIG_BOOTLOADER_APP_ROLLBACK_ENABLE
+    /* Same as esp_ota_begin(), unconfirmed app must not overwrite the rollback slot */
+    esp_ota_img_states_t ota_state;
+    if (esp_ota_get_state_partition(esp_ota_get_running_partition(), &ota_state) == ESP_OK &&
+        ota_state == ESP_OTA_IMG_PENDING_VERIFY) {
+        return ESP_ERR_OTA_ROLLBACK_INVALID_STATE;
+    }
+#endif
+
+    ota->sector = malloc(SPI_FLASH_SEC_SIZE);
+    ota->flash = malloc(SPI_FLASH_SEC_SIZE);
+
+    if (ota->sector == NULL || ota->flash == NULL) {
+        free(ota->sector);
+        free(ota->flash);
+        return ESP_ERR_NO_MEM;
+    }
+
+    return ESP_OK;
+#else
+    return esp_ota_begin(partition, OTA_SIZE_UNKNOWN, &ota->handle);
+#endif
+}
+
+#if CONFIG_WEBSERVER_OTA_SKIP_UNCHANGED
+static esp_err_t ota_writer_sector(ota_writer_t *ota) {
+
+    esp_err_t ret;
+    size_t len = ota->len;
+
+    if (ota->offset + len > ota->partition->size) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    ota->sectors++;
+
+    if (esp_partition_read(ota->partition, ota->offset, ota->flash, len) == ESP_OK &&
+        memcmp(ota->sector, ota->flash, len) == 0) {
+        ota->skipped++;
+    } else {
+        /* Encrypted partition is written by 16 bytes blocks */
+        memset(ota->sector + len, 0xff, SPI_FLASH_SEC_SIZE - len);
+        len = (len + 15) & ~15;
+
+        ret = esp_partition_erase_range(ota->partition, ota->offset, SPI_FLASH_SEC_SIZE);
+        if (ret != ESP_OK) return ret;
+
+        ret = esp_partition_write(ota->partition, ota->offset, ota->sector, len);
+        if (ret != ESP_OK) return ret;
+    }
+
+    ota->offset += SPI_FLASH_SEC_SIZE;
+    ota->len = 0;
+
+    return ESP_OK;
+}
+#endif
+
+static esp_err_t ota_writer_write(ota_writer_t *ota, const void *data, size_t len) {
+
+#if CONFIG_WEBSERVER_OTA_SKIP_UNCHANGED
+    esp_err_t ret;
+    size_t n;
+
+    if (ota->offset == 0 && ota->len == 0 && len && ((uint8_t*)data)[0] != ESP_IMAGE_HEADER_MAGIC) {
+        return ESP_ERR_OTA_VALIDATE_FAILED;
+    }
+
+    while (len) {
+        n = MIN(len, SPI_FLASH_SEC_SIZE - ota->len);
+        memcpy(ota->sector + ota->len, data, n);
+        ota->len += n;
+        data = (uint8_t*)data + n;
+        len -= n;
+        if (ota->len == SPI_FLASH_SEC_SIZE) {
+            ret = ota_writer_sector(ota);
+            if (ret != ESP_OK) return ret;
+        }
+    }
+
+    return ESP_OK;
+#else
+    ota->offset += len;
+    return esp_ota_write(ota->handle, data, len);
+#endif
+}
+
+static void ota_writer_abort(ota_writer_t *ota) {
+#if CONFIG_WEBSERVER_OTA_SKIP_UNCHANGED
+    free(ota->sector);
+    free(ota->flash);
+    ota->sector = ota->flash = NULL;
+#else
+    esp_ota_abort(ota->handle);
+#endif
+}
+
+static esp_err_t ota_writer_end(ota_writer_t *ota) {
+
+#if CONFIG_WEBSERVER_OTA_SKIP_UNCHANGED
+    esp_image_metadata_t metadata;
+    esp_err_t ret = ESP_OK;
+
+    if (ota->offset == 0 && ota->len == 0) {
+        ret = ESP_ERR_INVALID_ARG;
+    } else if (ota->len) {
+        ret = ota_writer_sector(ota);
+    }
+
+    ota_writer_abort(ota);
+
+    if (ret != ESP_OK) return ret;
+
+    const esp_partition_pos_t part_pos = {
+            .offset = ota->partition->address,
+            .size = ota->partition->size };
+
+    if (esp_image_verify(ESP_IMAGE_VERIFY, &part_pos, &metadata) != ESP_OK) {
+        return ESP_ERR_OTA_VALIDATE_FAILED;
+    }
+
+    printf("Unchanged sectors skipped: %u of %u (%u%%)\n",
+            ota->skipped, ota->sectors, ota->skipped * 100 / ota->sectors);
+
+    return ESP_OK;
+#else
+    ota->sectors = (ota->offset + SPI_FLASH_SEC_SIZE - 1) / SPI_FLASH_SEC_SIZE;
+    return esp_ota_end(ota->handle);
+#endif
+}
 
 static char* http_content_type(char *path) {
     char *ext = strrchr(path, '.');
@@ -84,33 +392,323 @@ static char* http_content_type(char *path) {
     return "text/plain";
 }
 
-static esp_err_t webserver_read_file(httpd_req_t *req) {
+static webserver_asset_t* webserver_asset_find(const char *name) {
+    for (int i = 0; i < sizeof(webserver_assets) / sizeof(webserver_assets[0]); i++) {
+        if (strcmp(webserver_assets[i].name, name) == 0) return &webserver_assets[i];
+    }
+    return NULL;
+}
 
+static void webserver_asset_drop(const char *name) {
+    webserver_asset_t *asset = webserver_asset_find(name);
+    if (asset && asset->data) {
+        free(asset->data);
+        asset->data = NULL;
+        asset->len = 0;
+    }
+}
+
+static void webserver_asset_load(const char *name) {
+
+    webserver_asset_t *asset = webserver_asset_find(name);
+    struct stat st;
     char buff[OTA_BUF_LEN];
+    FILE *f;
+
+    if (asset == NULL) return;
+
+    webserver_asset_drop(name);
+
+    sprintf(buff, "%s%s%s", webserver_html_path, DELIM, name);
+
+    if (stat(buff, &st) != 0 || st.st_size == 0 || st.st_size > ASSET_MAX_SIZE) return;
+
+    f = fopen(buff, "rb");
+    if (f == NULL) return;
+
+    asset->data = malloc(st.st_size);
+    if (asset->data) {
+        if (fread(asset->data, 1, st.st_size, f) == st.st_size) {
+            asset->len = st.st_size;
+        } else {
+            ESP_LOGE(TAG, "Cannot read file %s. (%s:%u)", buff, __FILE__, __LINE__);
+            free(asset->data);
+            asset->data = NULL;
+        }
+    }
+
+    fclose(f);
+}
+
+void webserver_preload() {
+    for (int i = 0; i < sizeof(webserver_assets) / sizeof(webserver_assets[0]); i++) {
+        webserver_asset_load(webserver_assets[i].name);
+    }
+}
+
+/* Response writer coalescing small writes into chunks of WEBSERVER_RESP_BUF_SIZE */
+typedef struct {
+    httpd_req_t *req;
+    size_t       len;
+    esp_err_t    ret;
+    char        *buf;
+} webserver_writer_t;
+
+#define WRITER_BUF_SIZE CONFIG_WEBSERVER_RESP_BUF_SIZE
+
+/* All handlers run in the single httpd task and one response is written
+ * at a time, so the writers share one buffer instead of the task stack */
+static char webserver_writer_buf[WRITER_BUF_SIZE];
+
+static void writer_init(webserver_writer_t *w, httpd_req_t *req) {
+    w->req = req;
+    w->buf = webserver_writer_buf;
+    w->len = 0;
+    w->ret = ESP_OK;
+}
+
+static esp_err_t writer_flush(webserver_writer_t *w) {
+    if (w->len && w->ret == ESP_OK) {
+        w->ret = httpd_resp_send_chunk(w->req, w->buf, w->len);
+    }
+    w->len = 0;
+    return w->ret;
+}
+
+static esp_err_t writer_write(webserver_writer_t *w, const char *data, size_t len) {
+
+    size_t n;
+
+    while (len && w->ret == ESP_OK) {
+        if (w->len == 0 && len >= WRITER_BUF_SIZE) {
+            /* Nothing to coalesce with, send as is */
+            w->ret = httpd_resp_send_chunk(w->req, data, len);
+            break;
+        }
+        n = MIN(len, WRITER_BUF_SIZE - w->len);
+        memcpy(w->buf + w->len, data, n);
+        w->len += n;
+        data += n;
+        len -= n;
+        if (w->len == WRITER_BUF_SIZE) writer_flush(w);
+    }
+
+    return w->ret;
+}
+
+static esp_err_t writer_str(webserver_writer_t *w, const char *str) {
+    return writer_write(w, str, strlen(str));
+}
+
+/* Read the file straight into the writer buffer */
+static esp_err_t writer_file(webserver_writer_t *w, FILE *f) {
+
     size_t read_len;
 
-    sprintf(buff, "%s%s", webserver_html_path, req->uri);
+    do {
+        read_len = fread(w->buf + w->len, 1, WRITER_BUF_SIZE - w->len, f);
+        w->len += read_len;
+        if (w->len == WRITER_BUF_SIZE) writer_flush(w);
+    } while (read_len > 0 && w->ret == ESP_OK);
+
+    return w->ret;
+}
+
+/* Flush the rest and finish chunked response */
+static esp_err_t writer_finish(webserver_writer_t *w) {
+    if (writer_flush(w) == ESP_OK) {
+        w->ret = httpd_resp_send_chunk(w->req, NULL, 0);
+    }
+    return w->ret;
+}
+
+/* Send the listing of html directory, without finishing the response */
+static esp_err_t webserver_send_listing(webserver_writer_t *w) {
+
+    DIR *dir;
+    struct dirent *de;
+    char *err = NULL;
+    char buff[1024];
+    char spaces[16];
+
+    FILE *fp;
+    struct stat file_stat;
+    size_t len, total_len, count_files;
+
+    if (!get_status_spiffs()) {
+        ESP_LOGE(TAG, "Spiffs not mount. (%s:%u)", __FILE__, __LINE__);
+        return ESP_FAIL;
+    }
+
+    dir = opendir(webserver_html_path);
+
+    if (!dir) {
+        ESP_LOGE(TAG, "Open \"%s\" directory failed. (%s:%u)", webserver_html_path, __FILE__, __LINE__);
+        return ESP_FAIL;
+    }
+
+    sprintf(buff, "Directory: %s\n\n", webserver_html_path);
+    writer_str(w, buff);
+
+    total_len = count_files = 0;
+
+    while ((de = readdir(dir))) {
+        sprintf(buff, "%s%s%s", webserver_html_path, DELIM, de->d_name);
+        fp = fopen(buff, "rb");
+        if (fp == NULL) {
+            err = "Cannot open file";
+            ESP_LOGE(TAG, "%s %s. (%s:%u)", err, de->d_name, __FILE__, __LINE__);
+            sprintf(buff, "<input type=\"checkbox\" name=\"file%u\" value=\"%s\">                %s\n",
+                                                                count_files++, de->d_name, de->d_name);
+        } else {
+            if (fstat(fileno(fp), &file_stat) == 0) {
+                sprintf(buff, "%ld", file_stat.st_size);
+                len = 7-strlen(buff);
+                memset(spaces, ' ', len);
+                spaces[len] = 0;
+                sprintf(buff, "<input type=\"checkbox\" name=\"file%u\" value=\"%s\"> %11lu    %s\n",
+                                            count_files++, de->d_name, file_stat.st_size, de->d_name);
+                total_len += file_stat.st_size;
+            }
+            fclose(fp);
+        }
+        writer_str(w, buff);
+    }
+
+    closedir(dir);
+
+    sprintf(buff, "\nUsed %9u    bytes\nFree %9u    bytes\n", total_len, get_fs_free_space());
+    writer_str(w, buff);
+
+    return ESP_OK;
+}
+
+static FILE* webserver_open_file(const char *name) {
+
+    webserver_asset_t *asset = webserver_asset_find(name);
+    char buff[OTA_BUF_LEN];
+
+    if (asset && asset->data) {
+        return fmemopen(asset->data, asset->len, "rb");
+    }
+
+    sprintf(buff, "%s%s%s", webserver_html_path, DELIM, name);
 
-    FILE *f = fopen(buff, "rb");
+    return fopen(buff, "rb");
+}
+
+static esp_err_t webserver_send_include(webserver_writer_t *w, const char *name) {
+
+    FILE *f;
+
+    f = webserver_open_file(name);
+    if (f == NULL) {
+        ESP_LOGE(TAG, "Cannot open include file %s. (%s:%u)", name, __FILE__, __LINE__);
+        return ESP_FAIL;
+    }
+
+    writer_file(w, f);
+
+    fclose(f);
+
+    return w->ret;
+}
+
+static esp_err_t webserver_send_directive(webserver_writer_t *w, const char *directive) {
+
+    char buff[32];
+    size_t full, used;
+
+    if (strcmp(directive, SSI_LISTING) == 0) {
+        return webserver_send_listing(w);
+    }
+
+    if (strcmp(directive, SSI_FREE) == 0 || strcmp(directive, SSI_USED) == 0) {
+        if (!get_fs_info(&full, &used)) return ESP_FAIL;
+        sprintf(buff, "%u", strcmp(directive, SSI_FREE) == 0 ? full - used : used);
+        return writer_str(w, buff);
+    }
+
+    if (strncmp(directive, SSI_INCLUDE, strlen(SSI_INCLUDE)) == 0) {
+        return webserver_send_include(w, directive + strlen(SSI_INCLUDE));
+    }
+
+    ESP_LOGE(TAG, "Unknown directive \"%s\". (%s:%u)", directive, __FILE__, __LINE__);
+    return ESP_FAIL;
+}
+
+/* Send the page expanding <!--#directive--> placeholders */
+static void webserver_send_ssi(webserver_writer_t *w, FILE *f) {
+
+    char buff[OTA_BUF_LEN + 1];
+    char *p, *tag, *end;
+    size_t len = 0, read_len, keep;
+    bool eof = false;
+
+    while (!eof || len) {
+        if (!eof) {
+            read_len = fread(buff + len, 1, OTA_BUF_LEN - len, f);
+            eof = read_len < OTA_BUF_LEN - len;
+            len += read_len;
+        }
+        buff[len] = 0;
+
+        p = buff;
+        while ((tag = strstr(p, SSI_BEGIN)) && (end = strstr(tag, SSI_END))) {
+            if (tag > p) writer_write(w, p, tag - p);
+            *end = 0;
+            webserver_send_directive(w, tag + strlen(SSI_BEGIN));
+            p = end + strlen(SSI_END);
+        }
+
+        if (eof || (tag == buff && len == OTA_BUF_LEN)) {
+            /* Nothing more to read or directive is too long, send the rest as is */
+            tag = buff + len;
+        } else if (tag == NULL) {
+            /* The tail may hold the beginning of a directive */
+            keep = MIN((size_t)(buff + len - p), strlen(SSI_BEGIN) - 1);
+            tag = buff + len - keep;
+        }
+
+        if (tag > p) writer_write(w, p, tag - p);
+
+        len = buff + len - tag;
+        memmove(buff, tag, len);
+    }
+}
+
+static esp_err_t webserver_read_file(httpd_req_t *req) {
+
+    webserver_writer_t w;
+    FILE *f;
+
+    if (!get_status_spiffs()) {
+        ESP_LOGE(TAG, "Spiffs not mount. (%s:%u)", __FILE__, __LINE__);
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Spiffs not mount");
+        return ESP_FAIL;
+    }
+
+    f = webserver_open_file(req->uri + 1);
     if (f == NULL) {
-        ESP_LOGE(TAG, "Cannot open file %s. (%s:%u)", buff, __FILE__, __LINE__);
+        ESP_LOGE(TAG, "Cannot open file %s%s. (%s:%u)", webserver_html_path, req->uri, __FILE__, __LINE__);
         httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "Not Found");
         return ESP_FAIL;
     }
 
-    char *type = http_content_type(buff);
+    char *type = http_content_type((char*)req->uri);
     httpd_resp_set_type(req, type);
 
-    do {
-        read_len = fread(buff, 1, sizeof(buff), f);
-        if (read_len > 0) httpd_resp_send_chunk(req, buff, read_len);
-    } while(read_len == sizeof(buff));
+    writer_init(&w, req);
 
-    httpd_resp_sendstr_chunk(req, NULL);
+    if (strcmp(type, "text/html") == 0) {
+        webserver_send_ssi(&w, f);
+    } else {
+        writer_file(&w, f);
+    }
 
     fclose(f);
 
-    return ESP_OK;
+    return writer_finish(&w);
 }
 
 static esp_err_t webserver_response(httpd_req_t *req) {
@@ -123,15 +721,66 @@ static esp_err_t webserver_response(httpd_req_t *req) {
 
     esp_err_t ret = webserver_read_file(req);
 
-    httpd_resp_sendstr_chunk(req, NULL);
+    if (webserver_first_response) {
+        webserver_first_response = false;
+        boot_profile_mark("first response");
+    }
 
     return ret;
 }
 
+/* Check whether the stored file has SHA-256 given in If-None-Match header */
+static bool webserver_unchanged(httpd_req_t *req, const char *path, char *hex) {
+
+    char etag[SHA256_HEX_LEN + 2];
+    uint8_t sha256[SHA256_LEN];
+    char *p = etag;
+
+    if (httpd_req_get_hdr_value_str(req, "If-None-Match", etag, sizeof(etag)) != ESP_OK) {
+        return false;
+    }
+
+    /* Value may be quoted as ETag */
+    if (*p == '"') p++;
+    if (strlen(p) && p[strlen(p) - 1] == '"') p[strlen(p) - 1] = 0;
+
+    if (!file_sha256(path, sha256)) {
+        return false;
+    }
+
+    sha256_to_hex(sha256, hex);
+
+    return strcasecmp(p, hex) == 0;
+}
+
+/* Reply 412 before the body is received when the stored file is unchanged */
+static bool webserver_upload_unchanged(httpd_req_t *req, const char *full_name) {
+
+    char buf[MAX_BUFF_RW / 2];
+    char etag[SHA256_HEX_LEN];
+
+    sprintf(buf, "%s%s", MOUNT_POINT_SPIFFS, full_name);
+
+    if (!webserver_unchanged(req, buf, etag)) {
+        return false;
+    }
+
+    ESP_LOGI(TAG, "File \"%s\" unchanged, upload skipped", full_name);
+    sprintf(buf, "\"%s\"", etag);
+    httpd_resp_set_status(req, "412 Precondition Failed");
+    httpd_resp_set_type(req, HTTPD_TYPE_TEXT);
+    httpd_resp_set_hdr(req, "ETag", buf);
+    httpd_resp_set_hdr(req, "Connection", "close");
+    httpd_resp_sendstr(req, "File unchanged");
+
+    return true;
+}
+
 static esp_err_t webserver_upload_html(httpd_req_t *req, const char *full_name) {
 
     FILE *fp = NULL;
     size_t global_cont_len, recorded_len = 0;
+    int64_t start;
     int received;
     char *tmpname, *newname, *name;
     char *err = "Unknown error";
@@ -189,6 +838,8 @@ static esp_err_t webserver_upload_html(httpd_req_t *req, const char *full_name)
     printf("Loading \"%s\" file\n", full_name);
     printf("Please wait\n");
 
+    start = esp_timer_get_time();
+
     while(global_cont_len) {
         /* Receive the file part by part into a buffer */
         if ((received = httpd_req_recv(req, buf, MIN(global_cont_len, MAX_BUFF_RW))) <= 0) {
@@ -242,7 +893,7 @@ static esp_err_t webserver_upload_html(httpd_req_t *req, const char *full_name)
 
     printf("\n");
 
-    printf("File transferred finished: %d bytes\n", recorded_len);
+    transfer_report("File", recorded_len, start);
 
     struct stat st;
     if (stat(newname, &st) == 0) {
@@ -257,6 +908,8 @@ static esp_err_t webserver_upload_html(httpd_req_t *req, const char *full_name)
         return ESP_FAIL;
     }
 
+    webserver_asset_load(full_name + strlen(PATH_HTML));
+
     name = strrchr (full_name, DELIM_CHR);
 
     if (name) name++;
@@ -273,12 +926,13 @@ static esp_err_t webserver_upload_html(httpd_req_t *req, const char *full_name)
 static esp_err_t webserver_update(httpd_req_t *req, const char *full_name) {
 
     const esp_partition_t *partition;
-    esp_ota_handle_t ota_handle;
+    ota_writer_t ota;
     esp_err_t ret = ESP_OK;
 
     size_t global_cont_len;
     size_t len;
     size_t global_recv_len = 0;
+    int received;
 
     char buf[OTA_BUF_LEN];
     char *err = "Unknown error";
@@ -287,6 +941,8 @@ static esp_err_t webserver_update(httpd_req_t *req, const char *full_name) {
     esp_image_header_t          *image_header = NULL;
     esp_app_desc_t              *app_desc = NULL;
 
+    int64_t start = esp_timer_get_time();
+
     global_cont_len = req->content_len;
 
     partition = esp_ota_get_next_update_partition(NULL);
@@ -299,11 +955,24 @@ static esp_err_t webserver_update(httpd_req_t *req, const char *full_name) {
             return ESP_FAIL;
         }
 
-        ret = esp_ota_begin(partition, OTA_SIZE_UNKNOWN, &ota_handle);
+        ret = ota_writer_begin(&ota, partition);
         if (ret == ESP_OK) {
             bool begin = true;
             while(global_cont_len) {
-                len = httpd_req_recv(req, buf, MIN(global_cont_len, OTA_BUF_LEN));
+                received = httpd_req_recv(req, buf, MIN(global_cont_len, OTA_BUF_LEN));
+                if (received <= 0) {
+                    if (received == HTTPD_SOCK_ERR_TIMEOUT) {
+                        /* Retry if timeout occurred */
+                        continue;
+                    }
+
+                    ota_writer_abort(&ota);
+                    err = "Firmware reception failed";
+                    ESP_LOGE(TAG, "%s. (%s:%u)", err, __FILE__, __LINE__);
+                    httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, err);
+                    return ESP_FAIL;
+                }
+                len = received;
                 if (len) {
                     if (begin) {
                         begin = false;
@@ -313,6 +982,7 @@ static esp_err_t webserver_update(httpd_req_t *req, const char *full_name) {
                                     sizeof(esp_image_segment_header_t));
                         if (image_header->magic != ESP_IMAGE_HEADER_MAGIC ||
                             app_desc->magic_word != ESP_APP_DESC_MAGIC_WORD) {
+                            ota_writer_abort(&ota);
                             err = "Invalid flash image type";
                             ESP_LOGE(TAG, "%s. (%s:%u)", err, __FILE__, __LINE__);
                             httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, err);
@@ -330,140 +1000,397 @@ static esp_err_t webserver_update(httpd_req_t *req, const char *full_name) {
                         printf("Please wait\n");
                         vTaskDelay(1000 / portTICK_PERIOD_MS);
                     }
-                    ret = esp_ota_write(ota_handle, (void*)buf, len);
+                    ret = ota_writer_write(&ota, buf, len);
                     if (ret != ESP_OK) {
-                        switch (ret) {
-                            case ESP_ERR_INVALID_ARG:
-                                err = "Handle is invalid";
-                                break;
-                            case ESP_ERR_OTA_VALIDATE_FAILED:
-                                err = "First byte of image contains invalid app image magic byte";
-                                break;
-                            case ESP_ERR_FLASH_OP_TIMEOUT:
-                            case ESP_ERR_FLASH_OP_FAIL:
-                                err = "Flash write failed";
-                                break;
-                            case ESP_ERR_OTA_SELECT_INFO_INVALID:
-                                err = "OTA data partition has invalid contents";
-                                break;
-                            default:
-                                err = "Unknown error";
-                                break;
-                        }
+                        ota_writer_abort(&ota);
+                        err = ota_write_err(ret);
+                        ESP_LOGE(TAG, "OTA write return error. %s. (%s:%d)", err, __FILE__, __LINE__);
+                        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, err);
+                        return ESP_FAIL;
+                    }
+                    global_recv_len += len;
+                    global_cont_len -= len;
+                    printf(".");
+                    fflush(stdout);
+                }
+            }
+            printf("\n");
+            transfer_report("Binary", global_recv_len, start);
+
+            ret = ota_writer_end(&ota);
+            if (ret != ESP_OK) {
+                err = ota_end_err(ret);
+                ESP_LOGE(TAG, "OTA end return error. %s. (%s:%d)", err, __FILE__, __LINE__);
+                httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, err);
+                return ESP_FAIL;
+            }
+            ret = esp_ota_set_boot_partition(partition);
+            if (ret != ESP_OK) {
+                err = "Set boot partition is error";
+                ESP_LOGE(TAG, "%s. (%s:%u)", err, __FILE__, __LINE__);
+                httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, err);
+                return ESP_FAIL;
+            }
+
+            name = strrchr (full_name, DELIM_CHR);
+
+            if (name) name++;
+
+            sprintf(buf, "File `%s` %d bytes uploaded successfully.\nUnchanged sectors skipped %u of %u.\nNext boot partition is %s.\nRestart system...",
+                    name?name:full_name, global_recv_len, ota.skipped, ota.sectors, partition->label);
+            httpd_resp_send(req, buf, strlen(buf));
+
+            xTaskCreate(&reboot_task, "reboot_task", 2048, NULL, 0, NULL);
+
+//            esp_wifi_disconnect();
+
+            const esp_partition_t *boot_partition = esp_ota_get_boot_partition();
+            printf("Next boot partition \"%s\" name subtype %d at offset 0x%x\n",
+                  boot_partition->label, boot_partition->subtype, boot_partition->address);
+            printf("Prepare to restart system!\n");
+            printf("Rebooting...\n");
+
+
+        } else {
+
+            err = ota_begin_err(ret);
+            ESP_LOGE(TAG, "OTA begin return error. %s. (%s:%u)", err, __FILE__, __LINE__);
+            httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, err);
+            return ESP_FAIL;
+
+        }
+
+
+    } else {
+        err = "No partiton";
+        ESP_LOGE(TAG, "%s. (%s:%u)", err, __FILE__, __LINE__);
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, err);
+        return ESP_FAIL;
+    }
+
+    return ESP_OK;
+}
+
+
+static esp_err_t webserver_send_firmware(httpd_req_t *req) {
+
+    const esp_partition_t *partition;
+    esp_image_metadata_t metadata;
+    mbedtls_sha256_context sha256_ctx;
+    uint8_t sha256[SHA256_LEN];
+    webserver_writer_t w;
+    char *err = "Unknown error";
+    size_t offset, len;
+
+    /* The running image never changes, so it is verified and hashed only once */
+    static size_t image_len = 0;
+    static char digest[SHA256_HEX_LEN] = {0};
+
+    partition = esp_ota_get_running_partition();
+
+    if (partition == NULL) {
+        err = "No partiton";
+        ESP_LOGE(TAG, "%s. (%s:%u)", err, __FILE__, __LINE__);
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, err);
+        return ESP_FAIL;
+    }
+
+    /* Writer buffer is also used to hash the image */
+    writer_init(&w, req);
+
+    if (image_len == 0) {
+        const esp_partition_pos_t part_pos = {
+                .offset = partition->address,
+                .size = partition->size };
+
+        if (esp_image_verify(ESP_IMAGE_VERIFY_SILENT, &part_pos, &metadata) != ESP_OK) {
+            err = "Running image is invalid";
+            ESP_LOGE(TAG, "%s. (%s:%u)", err, __FILE__, __LINE__);
+            httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, err);
+            return ESP_FAIL;
+        }
+
+        mbedtls_sha256_init(&sha256_ctx);
+        mbedtls_sha256_starts_ret(&sha256_ctx, 0);
+        for (offset = 0; offset < metadata.image_len; offset += len) {
+            len = MIN(metadata.image_len - offset, WRITER_BUF_SIZE);
+            if (esp_partition_read(partition, offset, w.buf, len) != ESP_OK) {
+                mbedtls_sha256_free(&sha256_ctx);
+                err = "Flash read failed";
+                ESP_LOGE(TAG, "%s. (%s:%u)", err, __FILE__, __LINE__);
+                httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, err);
+                return ESP_FAIL;
+            }
+            mbedtls_sha256_update_ret(&sha256_ctx, (unsigned char*)w.buf, len);
+        }
+        mbedtls_sha256_finish_ret(&sha256_ctx, sha256);
+        mbedtls_sha256_free(&sha256_ctx);
+        sha256_to_hex(sha256, digest);
+        image_len = metadata.image_len;
+    }
+
+    printf("Sending image partition name \"%s\" %d bytes, SHA-256 %s\n",
+            partition->label, image_len, digest);
+
+    httpd_resp_set_type(req, "application/octet-stream");
+    httpd_resp_set_hdr(req, HDR_SHA256, digest);
+
+    for (offset = 0; offset < image_len; offset += len) {
+        len = MIN(image_len - offset, WRITER_BUF_SIZE);
+        if (esp_partition_read(partition, offset, w.buf, len) != ESP_OK) {
+            /* Headers already sent, only dropping the connection is left */
+            ESP_LOGE(TAG, "Flash read failed at offset 0x%x. (%s:%u)", offset, __FILE__, __LINE__);
+            return ESP_FAIL;
+        }
+        w.len = len;
+        if (writer_flush(&w) != ESP_OK) {
+            ESP_LOGE(TAG, "Sending image failed. (%s:%u)", __FILE__, __LINE__);
+            return ESP_FAIL;
+        }
+    }
+
+    return writer_finish(&w);
+}
+
+static esp_err_t webserver_firmware(httpd_req_t *req) {
+
+    /* Serving peers is as large a transfer as an update */
+    transfer_mode_enter();
+    esp_err_t ret = webserver_send_firmware(req);
+    transfer_mode_exit();
+
+    return ret;
+}
+
+static esp_err_t pull_http_event(esp_http_client_event_t *evt) {
+
+    if (evt->event_id == HTTP_EVENT_ON_HEADER &&
+        strcasecmp(evt->header_key, HDR_SHA256) == 0 &&
+        strlen(evt->header_value) == SHA256_HEX_LEN - 1) {
+        strcpy((char*)evt->user_data, evt->header_value);
+    }
+
+    return ESP_OK;
+}
+
+static esp_err_t pull_image(esp_http_client_handle_t client, ota_writer_t *ota, const esp_partition_t *partition,
+                            const char *digest, size_t *recv_len, char **err) {
+
+    esp_err_t ret;
+    mbedtls_sha256_context sha256_ctx;
+    uint8_t sha256[SHA256_LEN];
+    char hex[SHA256_HEX_LEN];
+    char buf[OTA_BUF_LEN];
+    int content_len, len;
+    int64_t start = esp_timer_get_time();
+
+    /* esp_ota_begin() may erase the whole partition, do it before the peer connection is idle */
+    ret = ota_writer_begin(ota, partition);
+    if (ret != ESP_OK) {
+        *err = ota_begin_err(ret);
+        return ret;
+    }
+
+    ret = esp_http_client_open(client, 0);
+    if (ret != ESP_OK) {
+        ota_writer_abort(ota);
+        *err = "Connection to peer failed";
+        return ret;
+    }
+
+    content_len = esp_http_client_fetch_headers(client);
+
+    if (esp_http_client_get_status_code(client) != 200) {
+        ota_writer_abort(ota);
+        *err = "Peer did not return image";
+        return ESP_FAIL;
+    }
+
+    if (content_len > 0 && (size_t)content_len > partition->size) {
+        ota_writer_abort(ota);
+        *err = "Firmware image too large";
+        return ESP_FAIL;
+    }
 
-                        ESP_LOGE(TAG, "OTA write return error. %s. (%s:%d)", err, __FILE__, __LINE__);
-                        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, err);
-                        return ESP_FAIL;
-                    }
-                    global_recv_len += len;
-                    global_cont_len -= len;
-                    printf(".");
-                    fflush(stdout);
-                }
-            }
-            printf("\n");
-            printf("Binary transferred finished: %d bytes\n", global_recv_len);
+    mbedtls_sha256_init(&sha256_ctx);
+    mbedtls_sha256_starts_ret(&sha256_ctx, 0);
 
-            ret = esp_ota_end(ota_handle);
-            if (ret != ESP_OK) {
-                switch (ret) {
-                    case ESP_ERR_NOT_FOUND:
-                        err = "OTA handle was not found";
-                        break;
-                    case ESP_ERR_INVALID_ARG:
-                        err = "Handle was never written to";
-                        break;
-                    case ESP_ERR_OTA_VALIDATE_FAILED:
-                        err = "OTA image is invalid";
-                        break;
-                    case ESP_ERR_INVALID_STATE:
-                        err = "Internal error writing the final encrypted bytes to flash";
-                }
+    *recv_len = 0;
 
-                ESP_LOGE(TAG, "OTA end return error. %s. (%s:%d)", err, __FILE__, __LINE__);
-                httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, err);
-                return ESP_FAIL;
-            }
-            ret = esp_ota_set_boot_partition(partition);
-            if (ret != ESP_OK) {
-                err = "Set boot partition is error";
-                ESP_LOGE(TAG, "%s. (%s:%u)", err, __FILE__, __LINE__);
-                httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, err);
-                return ESP_FAIL;
-            }
+    while ((len = esp_http_client_read(client, buf, sizeof(buf))) > 0) {
+        ret = ota_writer_write(ota, buf, len);
+        if (ret != ESP_OK) {
+            *err = ota_write_err(ret);
+            break;
+        }
+        mbedtls_sha256_update_ret(&sha256_ctx, (unsigned char*)buf, len);
+        *recv_len += len;
+        printf(".");
+        fflush(stdout);
+    }
+    printf("\n");
 
-            name = strrchr (full_name, DELIM_CHR);
+    mbedtls_sha256_finish_ret(&sha256_ctx, sha256);
+    mbedtls_sha256_free(&sha256_ctx);
 
-            if (name) name++;
+    if (ret == ESP_OK && (len < 0 || !esp_http_client_is_complete_data_received(client))) {
+        *err = "Image reception failed";
+        ret = ESP_FAIL;
+    }
 
-            sprintf(buf, "File `%s` %d bytes uploaded successfully.\nNext boot partition is %s.\nRestart system...", name?name:full_name, global_recv_len, partition->label);
-            httpd_resp_send(req, buf, strlen(buf));
+    sha256_to_hex(sha256, hex);
 
-            xTaskCreate(&reboot_task, "reboot_task", 2048, NULL, 0, NULL);
+    if (ret == ESP_OK && digest[0] && strcasecmp(digest, hex) != 0) {
+        ESP_LOGE(TAG, "Expected SHA-256 %s, received %s", digest, hex);
+        *err = "Image digest mismatch";
+        ret = ESP_FAIL;
+    }
 
-//            esp_wifi_disconnect();
+    if (ret != ESP_OK) {
+        ota_writer_abort(ota);
+        return ret;
+    }
 
-            const esp_partition_t *boot_partition = esp_ota_get_boot_partition();
-            printf("Next boot partition \"%s\" name subtype %d at offset 0x%x\n",
-                  boot_partition->label, boot_partition->subtype, boot_partition->address);
-            printf("Prepare to restart system!\n");
-            printf("Rebooting...\n");
+    transfer_report("Binary", *recv_len, start);
+    printf("SHA-256 %s\n", hex);
+
+    ret = ota_writer_end(ota);
+    if (ret != ESP_OK) {
+        *err = ota_end_err(ret);
+        return ret;
+    }
 
+    return ESP_OK;
+}
 
-        } else {
+static esp_err_t webserver_pull_update(httpd_req_t *req) {
 
-            switch (ret) {
-                case ESP_ERR_INVALID_ARG:
-                    err = "Partition or out_handle arguments were NULL, or not OTA app partition";
-                    break;
-                case ESP_ERR_NO_MEM:
-                    err = "Cannot allocate memory for OTA operation";
-                    break;
-                case ESP_ERR_OTA_PARTITION_CONFLICT:
-                    err = "Partition holds the currently running firmware, cannot update in place";
-                    break;
-                case ESP_ERR_NOT_FOUND:
-                    err = "Partition argument not found in partition table";
-                    break;
-                case ESP_ERR_OTA_SELECT_INFO_INVALID:
-                    err = "The OTA data partition contains invalid data";
-                    break;
-                case ESP_ERR_INVALID_SIZE:
-                    err = "Partition doesnt fit in configured flash size";
-                    break;
-                case ESP_ERR_FLASH_OP_TIMEOUT:
-                case ESP_ERR_FLASH_OP_FAIL:
-                    err = "Flash write failed";
-                    break;
-                case ESP_ERR_OTA_ROLLBACK_INVALID_STATE:
-                    err = "The running app has not confirmed state";
-                    break;
-                default:
-                    err = "Unknown error";
-                    break;
+    const esp_partition_t *partition;
+    esp_http_client_handle_t client;
+    ota_writer_t ota;
+    esp_err_t ret;
+    size_t recv_len = 0;
+    int received;
+    char url[PULL_URL_LEN];
+    char digest[SHA256_HEX_LEN] = {0};
+    char buf[OTA_BUF_LEN];
+    char *err = "Unknown error";
+
+    if (req->content_len == 0 || req->content_len >= PULL_URL_LEN) {
+        err = "Invalid peer URL";
+        ESP_LOGE(TAG, "%s. (%s:%u)", err, __FILE__, __LINE__);
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, err);
+        return ESP_FAIL;
+    }
+
+    while (recv_len < req->content_len) {
+        if ((received = httpd_req_recv(req, url + recv_len, req->content_len - recv_len)) <= 0) {
+            if (received == HTTPD_SOCK_ERR_TIMEOUT) {
+                /* Retry if timeout occurred */
+                continue;
             }
-            ESP_LOGE(TAG, "OTA begin return error. %s. (%s:%u)", err, __FILE__, __LINE__);
+
+            err = "Data reception failed";
+            ESP_LOGE(TAG, "%s. (%s:%u)", err, __FILE__, __LINE__);
             httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, err);
             return ESP_FAIL;
-
         }
+        recv_len += received;
+    }
 
+    url[recv_len] = 0;
 
-    } else {
+    if (strlen(url) != recv_len) {
+        err = "Invalid peer URL";
+        ESP_LOGE(TAG, "%s. (%s:%u)", err, __FILE__, __LINE__);
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, err);
+        return ESP_FAIL;
+    }
+
+    recv_len = 0;
+
+    partition = esp_ota_get_next_update_partition(NULL);
+
+    if (partition == NULL) {
         err = "No partiton";
         ESP_LOGE(TAG, "%s. (%s:%u)", err, __FILE__, __LINE__);
         httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, err);
         return ESP_FAIL;
     }
 
+    esp_http_client_config_t client_config = {
+            .url = url,
+            .event_handler = pull_http_event,
+            .user_data = digest,
+            .buffer_size = OTA_BUF_LEN,
+            .timeout_ms = 10000 };
+
+    client = esp_http_client_init(&client_config);
+
+    if (client == NULL) {
+        err = "Invalid peer URL";
+        ESP_LOGE(TAG, "%s. (%s:%u)", err, __FILE__, __LINE__);
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, err);
+        return ESP_FAIL;
+    }
+
+    printf("Pulling image from \"%s\"\n", url);
+    printf("Writing to partition name \"%s\" subtype %d at offset 0x%x\n",
+          partition->label, partition->subtype, partition->address);
+    printf("Please wait\n");
+
+    ret = pull_image(client, &ota, partition, digest, &recv_len, &err);
+
+    esp_http_client_close(client);
+    esp_http_client_cleanup(client);
+
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Pull update error. %s. (%s:%u)", err, __FILE__, __LINE__);
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, err);
+        return ESP_FAIL;
+    }
+
+    ret = esp_ota_set_boot_partition(partition);
+    if (ret != ESP_OK) {
+        err = "Set boot partition is error";
+        ESP_LOGE(TAG, "%s. (%s:%u)", err, __FILE__, __LINE__);
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, err);
+        return ESP_FAIL;
+    }
+
+    sprintf(buf, "Image %d bytes pulled successfully.\nUnchanged sectors skipped %u of %u.\nNext boot partition is %s.\nRestart system...",
+            recv_len, ota.skipped, ota.sectors, partition->label);
+    httpd_resp_send(req, buf, strlen(buf));
+
+    xTaskCreate(&reboot_task, "reboot_task", 2048, NULL, 0, NULL);
+
+    printf("Prepare to restart system!\n");
+    printf("Rebooting...\n");
+
     return ESP_OK;
 }
 
+static esp_err_t webserver_pull(httpd_req_t *req) {
+
+    if (!admission_acquire(ADMISSION_OTA)) {
+        return webserver_busy(req);
+    }
+
+    transfer_mode_enter();
+    esp_err_t ret = webserver_pull_update(req);
+    transfer_mode_exit();
+
+    /* Successful update keeps the slot until restart */
+    if (ret != ESP_OK) admission_release(ADMISSION_OTA);
+
+    return ret;
+}
 
 static esp_err_t webserver_upload(httpd_req_t *req) {
 
     const char *full_path;
     char *err = NULL;
+    esp_err_t ret;
 
     full_path = req->uri+strlen(PATH_UPLOAD)-1;
 
@@ -475,7 +1402,23 @@ static esp_err_t webserver_upload(httpd_req_t *req) {
             return ESP_FAIL;
         }
 
-        return webserver_upload_html(req, full_path);
+        if (!admission_acquire(ADMISSION_UPLOAD)) {
+            return webserver_busy(req);
+        }
+
+        if (webserver_upload_unchanged(req, full_path)) {
+            /* Failure closes the connection, so the body is not received */
+            admission_release(ADMISSION_UPLOAD);
+            return ESP_FAIL;
+        }
+
+        transfer_mode_enter();
+        ret = webserver_upload_html(req, full_path);
+        transfer_mode_exit();
+
+        admission_release(ADMISSION_UPLOAD);
+
+        return ret;
 
     } else if (strncmp(full_path, PATH_IMAGE, strlen(PATH_IMAGE)) == 0) {
         if (strlen(full_path+strlen(PATH_IMAGE)) >= CONFIG_FATFS_MAX_LFN) {
@@ -485,7 +1428,18 @@ static esp_err_t webserver_upload(httpd_req_t *req) {
             return ESP_FAIL;
         }
 
-        return webserver_update(req, full_path);
+        if (!admission_acquire(ADMISSION_OTA)) {
+            return webserver_busy(req);
+        }
+
+        transfer_mode_enter();
+        ret = webserver_update(req, full_path);
+        transfer_mode_exit();
+
+        /* Successful update keeps the slot until restart */
+        if (ret != ESP_OK) admission_release(ADMISSION_OTA);
+
+        return ret;
 
     } else {
         err = "Invalid path";
@@ -499,7 +1453,7 @@ static esp_err_t webserver_upload(httpd_req_t *req) {
     return ESP_OK;
 }
 
-static esp_err_t webserver_delete(httpd_req_t *req) {
+static esp_err_t webserver_delete_files(httpd_req_t *req) {
 
     char buff[MAX_BUFF_RW] = {0};
     char *err = "Unknown error";
@@ -567,6 +1521,7 @@ static esp_err_t webserver_delete(httpd_req_t *req) {
             httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, err);
             return ESP_FAIL;
         }
+        webserver_asset_drop(file->valuestring);
         ESP_LOGI(TAG, "Deleting a file: %s", file->valuestring);
     }
 
@@ -576,65 +1531,184 @@ static esp_err_t webserver_delete(httpd_req_t *req) {
 }
 
 
+static esp_err_t webserver_delete(httpd_req_t *req) {
 
-static esp_err_t webserver_list(httpd_req_t *req) {
+    if (!admission_acquire(ADMISSION_REQUEST)) {
+        return webserver_busy(req);
+    }
 
-    DIR *dir;
-    struct dirent *de;
-    char *err = NULL;
-    char buff[1024];
-    char spaces[16];
+    esp_err_t ret = webserver_delete_files(req);
 
-    FILE *fp;
-    struct stat file_stat;
-    size_t len, total_len, count_files;
-    dir = opendir(webserver_html_path);
+    admission_release(ADMISSION_REQUEST);
 
-    if (!dir) {
-        sprintf(buff, "Open \"%s\" directory failed", webserver_html_path);
-        ESP_LOGE(TAG, "%s. (%s:%u)", buff, __FILE__, __LINE__);
-        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, buff);
+    return ret;
+}
+
+static esp_err_t webserver_check_files(httpd_req_t *req) {
+
+    char *err = "Unknown error";
+    char *buff, *out;
+    char path[MAX_BUFF_RW / 2];
+    char hex[SHA256_HEX_LEN];
+    uint8_t sha256[SHA256_LEN];
+    size_t recv_len = 0;
+    int received;
+
+    if (!get_status_spiffs()) {
+        err = "Spiffs not mount";
+        ESP_LOGE(TAG, "%s. (%s:%u)", err, __FILE__, __LINE__);
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, err);
         return ESP_FAIL;
     }
 
-    sprintf(buff, "Directory: %s\n\n", webserver_html_path);
-    httpd_resp_sendstr_chunk(req, buff);
+    if (req->content_len == 0 || req->content_len > CHECK_MAX_LEN) {
+        err = "Data too large";
+        ESP_LOGE(TAG, "%s. (%s:%u)", err, __FILE__, __LINE__);
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, err);
+        return ESP_FAIL;
+    }
 
-    total_len = count_files = 0;
+    buff = malloc(req->content_len + 1);
+    if (buff == NULL) {
+        err = "Error allocation memory";
+        ESP_LOGE(TAG, "%s. (%s:%u)", err, __FILE__, __LINE__);
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, err);
+        return ESP_FAIL;
+    }
 
-    while ((de = readdir(dir))) {
-        sprintf(buff, "%s%s%s", webserver_html_path, DELIM, de->d_name);
-        fp = fopen(buff, "rb");
-        if (fp == NULL) {
-            err = "Cannot open file";
-            ESP_LOGE(TAG, "%s %s. (%s:%u)", err, de->d_name, __FILE__, __LINE__);
-            sprintf(buff, "<input type=\"checkbox\" name=\"file%u\" value=\"%s\">                %s\n",
-                                                                count_files++, de->d_name, de->d_name);
-        } else {
-            if (fstat(fileno(fp), &file_stat) == 0) {
-                sprintf(buff, "%ld", file_stat.st_size);
-                len = 7-strlen(buff);
-                memset(spaces, ' ', len);
-                spaces[len] = 0;
-                sprintf(buff, "<input type=\"checkbox\" name=\"file%u\" value=\"%s\"> %11lu    %s\n",
-                                            count_files++, de->d_name, file_stat.st_size, de->d_name);
-                total_len += file_stat.st_size;
+    while (recv_len < req->content_len) {
+        if ((received = httpd_req_recv(req, buff + recv_len, req->content_len - recv_len)) <= 0) {
+            if (received == HTTPD_SOCK_ERR_TIMEOUT) {
+                /* Retry if timeout occurred */
+                continue;
             }
-            fclose(fp);
+
+            free(buff);
+            err = "Data reception failed";
+            ESP_LOGE(TAG, "%s. (%s:%u)", err, __FILE__, __LINE__);
+            httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, err);
+            return ESP_FAIL;
         }
-        httpd_resp_sendstr_chunk(req, buff);
+        recv_len += received;
     }
 
-    closedir(dir);
+    buff[recv_len] = 0;
 
-    sprintf(buff, "\nUsed %9u    bytes\nFree %9u    bytes\n", total_len, get_fs_free_space());
-    httpd_resp_sendstr_chunk(req, buff);
+    cJSON *root = cJSON_Parse(buff);
+    free(buff);
+
+    if (root == NULL) {
+        err = "JSON not found";
+        ESP_LOGE(TAG, "%s. (%s:%u)", err, __FILE__, __LINE__);
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, err);
+        return ESP_FAIL;
+    }
+
+    cJSON *files_array = cJSON_GetObjectItem(root, "Files");
+    cJSON *answer = cJSON_CreateObject();
+    cJSON *changed = cJSON_AddArrayToObject(answer, "Changed");
+
+    if (files_array == NULL || changed == NULL) {
+        cJSON_Delete(answer);
+        cJSON_Delete(root);
+        err = files_array ? "Error allocation memory" : "Array key not found";
+        ESP_LOGE(TAG, "%s. (%s:%u)", err, __FILE__, __LINE__);
+        httpd_resp_send_err(req, files_array ? HTTPD_500_INTERNAL_SERVER_ERROR : HTTPD_400_BAD_REQUEST, err);
+        return ESP_FAIL;
+    }
+
+    int files_array_size = cJSON_GetArraySize(files_array);
+    for (int i = 0; i < files_array_size; i++) {
+        cJSON *file = cJSON_GetArrayItem(files_array, i);
+        cJSON *name = cJSON_GetObjectItem(file, "Name");
+        cJSON *hash = cJSON_GetObjectItem(file, "SHA256");
+
+        if (!cJSON_IsObject(file) || !cJSON_IsString(name) ||
+            strlen(name->valuestring) >= CONFIG_FATFS_MAX_LFN) {
+            /* Entry which cannot be checked must not be taken as unchanged */
+            cJSON_Delete(answer);
+            cJSON_Delete(root);
+            err = "Invalid file entry";
+            ESP_LOGE(TAG, "%s. (%s:%u)", err, __FILE__, __LINE__);
+            httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, err);
+            return ESP_FAIL;
+        }
+
+        sprintf(path, "%s%s%s", webserver_html_path, DELIM, name->valuestring);
+
+        if (cJSON_IsString(hash) && file_sha256(path, sha256)) {
+            sha256_to_hex(sha256, hex);
+            if (strcasecmp(hash->valuestring, hex) == 0) continue;
+        }
+
+        /* Changed file left out of the answer would be taken as unchanged */
+        int changed_size = cJSON_GetArraySize(changed);
+        cJSON *item = cJSON_CreateString(name->valuestring);
+        if (item) cJSON_AddItemToArray(changed, item);
+        if (item == NULL || cJSON_GetArraySize(changed) != changed_size + 1) {
+            cJSON_Delete(answer);
+            cJSON_Delete(root);
+            err = "Error allocation memory";
+            ESP_LOGE(TAG, "%s. (%s:%u)", err, __FILE__, __LINE__);
+            httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, err);
+            return ESP_FAIL;
+        }
+    }
+
+    cJSON_Delete(root);
+
+    out = cJSON_PrintUnformatted(answer);
+    cJSON_Delete(answer);
+
+    if (out == NULL) {
+        err = "Error allocation memory";
+        ESP_LOGE(TAG, "%s. (%s:%u)", err, __FILE__, __LINE__);
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, err);
+        return ESP_FAIL;
+    }
 
-    httpd_resp_sendstr_chunk(req, NULL);
+    httpd_resp_set_type(req, HTTPD_TYPE_JSON);
+    httpd_resp_sendstr(req, out);
+    free(out);
 
     return ESP_OK;
 }
 
+static esp_err_t webserver_check(httpd_req_t *req) {
+
+    if (!admission_acquire(ADMISSION_REQUEST)) {
+        return webserver_busy(req);
+    }
+
+    esp_err_t ret = webserver_check_files(req);
+
+    admission_release(ADMISSION_REQUEST);
+
+    return ret;
+}
+
+static esp_err_t webserver_list(httpd_req_t *req) {
+
+    webserver_writer_t w;
+    char buff[128];
+
+    if (!get_status_spiffs()) {
+        ESP_LOGE(TAG, "Spiffs not mount. (%s:%u)", __FILE__, __LINE__);
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Spiffs not mount");
+        return ESP_FAIL;
+    }
+
+    writer_init(&w, req);
+
+    if (webserver_send_listing(&w) != ESP_OK) {
+        sprintf(buff, "Open \"%s\" directory failed", webserver_html_path);
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, buff);
+        return ESP_FAIL;
+    }
+
+    return writer_finish(&w);
+}
+
 
 static httpd_handle_t webserver_start(void) {
 
@@ -658,6 +1732,12 @@ static httpd_handle_t webserver_start(void) {
         if (ret != ESP_OK) ESP_LOGE(TAG, "URL \"%s\" not registered. (%s:%u)", list_html.uri, __FILE__, __LINE__);
         ret = httpd_register_uri_handler(server, &delete_html);
         if (ret != ESP_OK) ESP_LOGE(TAG, "URL \"%s\" not registered. (%s:%u)", delete_html.uri, __FILE__, __LINE__);
+        ret = httpd_register_uri_handler(server, &firmware_html);
+        if (ret != ESP_OK) ESP_LOGE(TAG, "URL \"%s\" not registered. (%s:%u)", firmware_html.uri, __FILE__, __LINE__);
+        ret = httpd_register_uri_handler(server, &pull_html);
+        if (ret != ESP_OK) ESP_LOGE(TAG, "URL \"%s\" not registered. (%s:%u)", pull_html.uri, __FILE__, __LINE__);
+        ret = httpd_register_uri_handler(server, &check_html);
+        if (ret != ESP_OK) ESP_LOGE(TAG, "URL \"%s\" not registered. (%s:%u)", check_html.uri, __FILE__, __LINE__);
         ret = httpd_register_uri_handler(server, &uri_html);
         if (ret != ESP_OK) ESP_LOGE(TAG, "URL \"%s\" not registered. (%s:%u)", uri_html.uri, __FILE__, __LINE__);
         return server;
@@ -667,25 +1747,16 @@ static httpd_handle_t webserver_start(void) {
     return NULL;
 }
 
-static void webserver_stop(httpd_handle_t server) {
-    // Stop the httpd server
-    httpd_stop(server);
-}
-
 static void webserver_disconnect_handler(void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data) {
-    httpd_handle_t *server = (httpd_handle_t*) arg;
-//    if (*server && !staApModeNow) {
-    if (*server) {
-        ESP_LOGI(TAG, "Stopping webserver");
-        webserver_stop(*server);
-        *server = NULL;
-    }
+    /* Webserver keeps running, connections are served again as soon as Wi-Fi is back */
+    ESP_LOGI(TAG, "Wi-Fi disconnected");
 }
 
 static void webserver_connect_handler(void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data) {
     httpd_handle_t *server = (httpd_handle_t*) arg;
+    boot_profile_mark("got ip");
+    webserver_first_response = true;
     if (*server == NULL) {
-//        ESP_LOGI(TAG, "Starting webserver");
         *server = webserver_start();
     }
 }
@@ -706,6 +1777,9 @@ void webserver_init(const char *html_path) {
 
     strcpy(webserver_html_path, html_path);
 
+    /* Start listening before Wi-Fi is connected */
+    server = webserver_start();
+
     ESP_ERROR_CHECK(esp_event_handler_register(IP_EVENT, IP_EVENT_STA_GOT_IP, &webserver_connect_handler, &server));
     ESP_ERROR_CHECK(esp_event_handler_register(IP_EVENT, IP_EVENT_AP_STAIPASSIGNED, &webserver_connect_handler, &server));
     ESP_ERROR_CHECK(esp_event_handler_register(WIFI_EVENT, WIFI_EVENT_STA_DISCONNECTED, &webserver_disconnect_handler, &server));
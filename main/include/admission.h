@@ -0,0 +1,14 @@
+#ifndef MAIN_INCLUDE_ADMISSION_H_
+#define MAIN_INCLUDE_ADMISSION_H_
+
+typedef enum {
+    ADMISSION_OTA = 0,      /* Firmware update, held until restart */
+    ADMISSION_UPLOAD,       /* File upload to SPIFFS */
+    ADMISSION_REQUEST,      /* Requests parsing JSON */
+    ADMISSION_MAX
+} admission_class_t;
+
+bool admission_acquire(admission_class_t cls);
+void admission_release(admission_class_t cls);
+
+#endif /* MAIN_INCLUDE_ADMISSION_H_ */
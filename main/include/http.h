@@ -5,6 +5,7 @@
 #define MODULE_NAME "Lolin ESP32"
 
 void webserver_init(const char *html_path);
+void webserver_preload();
 void webserver_restart();
 
 #endif /* MAIN_INCLUDE_HTTP_H_ */
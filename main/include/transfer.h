@@ -0,0 +1,8 @@
+#ifndef MAIN_INCLUDE_TRANSFER_H_
+#define MAIN_INCLUDE_TRANSFER_H_
+
+void transfer_mode_enter();
+void transfer_mode_exit();
+const char* transfer_mode_name();
+
+#endif /* MAIN_INCLUDE_TRANSFER_H_ */
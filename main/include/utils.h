@@ -5,9 +5,18 @@
 #define DELIM               "/"
 #define DELIM_CHR           '/'
 #define MAX_BUFF_RW         2048
+#define SHA256_LEN          32
+#define SHA256_HEX_LEN      (SHA256_LEN * 2 + 1)
+/* How long a request waits for SPIFFS still being mounted at startup */
+#define SPIFFS_WAIT_MS      5000
 
 bool get_status_spiffs();
 size_t get_fs_free_space();
+bool get_fs_info(size_t *full, size_t *used);
 void init_spiffs();
+void init_spiffs_task(void (*preload)(void));
+void boot_profile_mark(const char *phase);
+void sha256_to_hex(const uint8_t *sha256, char *hex);
+bool file_sha256(const char *path, uint8_t *sha256);
 
 #endif /* MAIN_INCLUDE_UTILS_H_ */
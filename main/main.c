@@ -24,21 +24,25 @@ static char *TAG = "web_server_main";
 
 void app_main(void) {
 
+    boot_profile_mark("app_main");
+
     ESP_ERROR_CHECK(nvs_flash_init());
     ESP_ERROR_CHECK(esp_netif_init());
     ESP_ERROR_CHECK(esp_event_loop_create_default());
 
+    boot_profile_mark("nvs and netif");
+
     ESP_LOGI(TAG, "Startup...");
     ESP_LOGI(TAG, "Free memory: %d bytes", esp_get_free_heap_size());
     ESP_LOGI(TAG, "IDF version: %s", esp_get_idf_version());
 
-    init_spiffs();
-
     webserver_init(HTML_PATH);
 
-    ESP_ERROR_CHECK(example_connect());
-
+    boot_profile_mark("webserver started");
 
+    init_spiffs_task(webserver_preload);
 
+    ESP_ERROR_CHECK(example_connect());
 
+    boot_profile_mark("wifi connected");
 }
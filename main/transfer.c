@@ -0,0 +1,87 @@
+#include <stdbool.h>
+
+#include "esp_log.h"
+#include "esp_pm.h"
+#include "esp_wifi.h"
+
+#include "transfer.h"
+
+/* Transfer mode keeps CPU/APB at max frequency and Wi-Fi awake while a large
+ * transfer is running, previous settings are restored after the last one.
+ * It is only used from the single httpd task, so no locking is needed. */
+
+static const char *TAG = "web_server_transfer";
+
+static int transfer_count = 0;
+
+#if CONFIG_WEBSERVER_TRANSFER_PERFORMANCE && CONFIG_PM_ENABLE
+static esp_pm_lock_handle_t transfer_cpu_lock = NULL;
+static esp_pm_lock_handle_t transfer_apb_lock = NULL;
+#endif
+
+#if CONFIG_WEBSERVER_TRANSFER_PERFORMANCE || CONFIG_WEBSERVER_TRANSFER_WIFI
+static wifi_ps_type_t transfer_ps;
+static bool transfer_ps_saved = false;
+#endif
+
+const char* transfer_mode_name() {
+#if CONFIG_WEBSERVER_TRANSFER_PERFORMANCE
+    return "performance";
+#elif CONFIG_WEBSERVER_TRANSFER_WIFI
+    return "wifi";
+#else
+    return "power save";
+#endif
+}
+
+static void transfer_mode_on() {
+
+#if CONFIG_WEBSERVER_TRANSFER_PERFORMANCE && CONFIG_PM_ENABLE
+    if (transfer_cpu_lock == NULL &&
+        esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0, "transfer_cpu", &transfer_cpu_lock) != ESP_OK) {
+        ESP_LOGE(TAG, "CPU frequency lock not created. (%s:%u)", __FILE__, __LINE__);
+        transfer_cpu_lock = NULL;
+    }
+    if (transfer_apb_lock == NULL &&
+        esp_pm_lock_create(ESP_PM_APB_FREQ_MAX, 0, "transfer_apb", &transfer_apb_lock) != ESP_OK) {
+        ESP_LOGE(TAG, "APB frequency lock not created. (%s:%u)", __FILE__, __LINE__);
+        transfer_apb_lock = NULL;
+    }
+    if (transfer_cpu_lock) esp_pm_lock_acquire(transfer_cpu_lock);
+    if (transfer_apb_lock) esp_pm_lock_acquire(transfer_apb_lock);
+#endif
+
+#if CONFIG_WEBSERVER_TRANSFER_PERFORMANCE || CONFIG_WEBSERVER_TRANSFER_WIFI
+    transfer_ps_saved = esp_wifi_get_ps(&transfer_ps) == ESP_OK;
+    if (transfer_ps_saved && transfer_ps != WIFI_PS_NONE) {
+        esp_wifi_set_ps(WIFI_PS_NONE);
+    }
+#endif
+
+    ESP_LOGI(TAG, "Transfer mode \"%s\" on", transfer_mode_name());
+}
+
+static void transfer_mode_off() {
+
+#if CONFIG_WEBSERVER_TRANSFER_PERFORMANCE || CONFIG_WEBSERVER_TRANSFER_WIFI
+    if (transfer_ps_saved && transfer_ps != WIFI_PS_NONE) {
+        esp_wifi_set_ps(transfer_ps);
+    }
+    transfer_ps_saved = false;
+#endif
+
+#if CONFIG_WEBSERVER_TRANSFER_PERFORMANCE && CONFIG_PM_ENABLE
+    if (transfer_apb_lock) esp_pm_lock_release(transfer_apb_lock);
+    if (transfer_cpu_lock) esp_pm_lock_release(transfer_cpu_lock);
+#endif
+
+    ESP_LOGI(TAG, "Transfer mode \"%s\" off", transfer_mode_name());
+}
+
+void transfer_mode_enter() {
+    if (transfer_count++ == 0) transfer_mode_on();
+}
+
+void transfer_mode_exit() {
+    if (transfer_count && --transfer_count == 0) transfer_mode_off();
+}
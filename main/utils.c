@@ -1,13 +1,31 @@
+#include <stdio.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/event_groups.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "esp_spiffs.h"
+#include "mbedtls/sha256.h"
 
 #include "utils.h"
 
 static const char *TAG = "web_server_utils";
 
+#define SPIFFS_READY_BIT BIT0
+
 static bool spiffs;
+static EventGroupHandle_t spiffs_events = NULL;
+static void (*spiffs_preload)(void) = NULL;
 
 bool get_status_spiffs() {
+    /* Wait while SPIFFS is being mounted in background */
+    if (spiffs_events) {
+        /* Not ready until preload is done as well, assets are being loaded until then */
+        EventBits_t bits = xEventGroupWaitBits(spiffs_events, SPIFFS_READY_BIT, pdFALSE, pdTRUE,
+                                               SPIFFS_WAIT_MS / portTICK_PERIOD_MS);
+        if (!(bits & SPIFFS_READY_BIT)) return false;
+    }
     return spiffs;
 }
 
@@ -21,8 +39,6 @@ void init_spiffs() {
 
     ESP_LOGI(TAG, "Initialize SPIFFS");
 
-    spiffs = true;
-
     esp_err_t ret = esp_vfs_spiffs_register(&spiffs_conf);
 
     if (ret != ESP_OK) {
@@ -36,17 +52,94 @@ void init_spiffs() {
             ESP_LOGE(TAG, "Mount or format fails. (%s:%u)", __FILE__, __LINE__);
         }
         spiffs = false;
+        return;
+    }
+
+    spiffs = true;
+}
+
+static void spiffs_task(void *pvParameter) {
+
+    init_spiffs();
+    boot_profile_mark("spiffs mounted");
+
+    if (spiffs && spiffs_preload) {
+        spiffs_preload();
+        boot_profile_mark("assets preloaded");
     }
+
+    xEventGroupSetBits(spiffs_events, SPIFFS_READY_BIT);
+    vTaskDelete(NULL);
+}
+
+/* Mount SPIFFS and preload assets in parallel with Wi-Fi connection */
+void init_spiffs_task(void (*preload)(void)) {
+
+    spiffs_events = xEventGroupCreate();
+
+    if (spiffs_events == NULL) {
+        ESP_LOGE(TAG, "Error allocation memory. (%s:%u)", __FILE__, __LINE__);
+        init_spiffs();
+        return;
+    }
+
+    spiffs_preload = preload;
+
+    if (xTaskCreate(&spiffs_task, "spiffs_task", 4096, NULL, 5, NULL) != pdPASS) {
+        ESP_LOGE(TAG, "Error creating SPIFFS task. (%s:%u)", __FILE__, __LINE__);
+        init_spiffs();
+        xEventGroupSetBits(spiffs_events, SPIFFS_READY_BIT);
+    }
+}
+
+void boot_profile_mark(const char *phase) {
+    ESP_LOGI(TAG, "Boot profile: %s at %lld ms", phase, esp_timer_get_time() / 1000);
+}
+
+bool get_fs_info(size_t *full, size_t *used) {
+    return esp_spiffs_info(spiffs_conf.partition_label, full, used) == ESP_OK;
 }
 
 size_t get_fs_free_space() {
     size_t full;
     size_t used;
 
-    if (esp_spiffs_info(spiffs_conf.partition_label, &full, &used) != ESP_OK) {
+    if (!get_fs_info(&full, &used)) {
         return 0;
     }
 
     return full - used;
 }
 
+
+void sha256_to_hex(const uint8_t *sha256, char *hex) {
+
+    for (int i = 0; i < SHA256_LEN; i++) {
+        sprintf(hex + i * 2, "%02x", sha256[i]);
+    }
+    hex[SHA256_HEX_LEN - 1] = 0;
+}
+
+bool file_sha256(const char *path, uint8_t *sha256) {
+
+    mbedtls_sha256_context sha256_ctx;
+    char buff[MAX_BUFF_RW / 2];
+    size_t read_len;
+
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) return false;
+
+    mbedtls_sha256_init(&sha256_ctx);
+    mbedtls_sha256_starts_ret(&sha256_ctx, 0);
+
+    while ((read_len = fread(buff, 1, sizeof(buff), f)) > 0) {
+        mbedtls_sha256_update_ret(&sha256_ctx, (unsigned char*)buff, read_len);
+    }
+
+    mbedtls_sha256_finish_ret(&sha256_ctx, sha256);
+    mbedtls_sha256_free(&sha256_ctx);
+
+    fclose(f);
+
+    return true;
+}